@@ -18,6 +18,13 @@
   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
   THE SOFTWARE.*/
 
+//FreeSpace Open can read files compressed with LZ4. A compressed file starts with "LZ41", followed by the LZ4 blocks,
+//the offset of each block plus one for the end of the last block, and finally the number of offsets, the uncompressed size
+//and the block size as ints
+#define LZ41_HEADER "LZ41"
+#define LZ41_BLOCK_SIZE 65536
+#define LZ41_TRAILER_SIZE 12
+
 struct vp_header
 {
 	char vp_header [4];
@@ -41,6 +48,10 @@ struct file_node
 	char* name;
 	int num_children;
 	struct file_node* children;
-	char* data; //Only used in vpp.c
+	char* path; //Only used in vpp.c
+	int source; //Only used in vpp.c, VP file the data is merged from (-1 for files on disk)
+	int source_offset; //Only used in vpp.c, offset in the VP file the data is merged from or position in the manifest
+	int spill; //Only used in vpp.c, descriptor of the spill file holding the compressed data (-1 if stored as is)
+	long spill_offset; //Only used in vpp.c, where the compressed data starts in the spill file
 	time_t last_modified;
 } file_node;
@@ -18,21 +18,69 @@
   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
   THE SOFTWARE.*/
 
+#define _GNU_SOURCE //For copy_file_range
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "vp.h"
 
+#define MAX_THREADS 32
+#define LZ4_HASH_BITS 16
+
 struct file_node file_tree_root;
-struct file_node last_file_created;
-struct file_node first_dir_entry = {.offset = sizeof (struct vp_header), .size = 0, .name = NULL, .num_children = 0, .children = NULL, .data = NULL};
+int next_offset = sizeof (struct vp_header); //File data starts right after the header
 int num_direntries = 1;
+int* source_fds = NULL; //VP files being merged, indexed by file_node.source
+
+//Directories waiting to be scanned, shared between the scanner threads
+struct file_node** scan_queue = NULL;
+int scan_queue_length = 0;
+int scan_queue_capacity = 0;
+int scan_pending = 0; //Directories that are queued or still being scanned
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+
+//Flat list of the files on disk, for compressing them and for laying them out in manifest order
+struct file_node** file_list = NULL;
+int file_list_length = 0;
+int file_list_capacity = 0;
+int compress_next = 0; //Next file in file_list for the compression threads to grab
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Compressed data waits in one spill file per compression thread until it gets copied into the VP file, rather than in memory
+int spill_files [MAX_THREADS];
+int num_spill_files = 0;
 
-void read_dir (struct file_node* parent, DIR* to_read, char* path);
+int thread_count ();
+void read_dir (struct file_node* parent);
+void queue_dir (struct file_node* dir);
+void* scan_worker (void* unused);
+void scan_tree (struct file_node* root);
+int lz4_compress_block (unsigned char* in, int in_size, unsigned char* out, int* hash_table);
+long compress_file (struct file_node* file, int* hash_table, unsigned char* in, unsigned char* out, int spill, long spill_size);
+void collect_files (struct file_node* parent);
+void* compress_worker (void* spill_ptr);
+void compress_tree (char* vp_path);
+void read_manifest (char* manifest_path);
+void add_manifest_file (char* vp_path, int position);
+struct file_node* add_manifest_child (struct file_node* parent, char* name, int is_dir);
+int compare_manifest_position (const void* file1, const void* file2);
+void assign_manifest_offsets ();
+void assign_offsets (struct file_node* parent);
+void merge_vp (char* path, int source);
+int merge_dir (struct file_node* parent, struct dir_entry* index, struct dir_entry* end, int source);
+struct file_node* merge_child (struct file_node* parent, struct dir_entry* entry, int source);
+void free_tree (struct file_node* root);
+int copy_range (int from, off_t from_offset, int to, off_t to_offset, size_t length);
 char* append_dir_path (char* string1, char* string2);
 void write_vp (char* path);
 void write_vp_header (FILE* to_write);
@@ -76,85 +124,787 @@ char* append_dir_path (char* string1, char* string2)
 	return ret;
 }
 
-void read_dir (struct file_node* parent, DIR* to_read, char* path)
+void read_dir (struct file_node* parent)
 {
-	DIR* subdir;
+	DIR* to_read;
 	struct dirent *entry; //This is the UNIX dir entry structure, not the one we use in VP files
-	char* subdir_name;
 	struct file_node* new_child;
-	size_t file_size;
-	FILE* input_file;
 	struct stat status;
+	int capacity = 0;
+	int is_dir;
+	int loop;
+
+	to_read = opendir (parent->path);
+	if (!to_read)
+	{
+		printf ("%s: Could not open directory\n", parent->path);
+		exit (-1);
+	}
 
 	entry = readdir (to_read);
 	while (entry)
 	{
 		if (strcmp (entry->d_name, ".") && strcmp (entry->d_name, ".."))
 		{
-			subdir_name = append_dir_path (path, entry->d_name);
-
-			//Try to open the given path as a directory
-			errno = 0;
-			subdir = opendir (subdir_name);
-
-			num_direntries ++;
-
-			//Initialize the new child
-			parent->num_children ++;
-			if (parent->num_children == 1)
-				parent->children = malloc (sizeof (struct file_node));
-			else
-				parent->children = realloc (parent->children, parent->num_children * sizeof (struct file_node)); //Do note there's a possibility of an address change (THIS MEANS last_file_created cannot be a pointer)
-			new_child = &(parent->children [parent->num_children-1]);
-			new_child->children = NULL;
-			new_child->num_children = 0;
-			new_child->name = malloc (strlen (entry->d_name)+1);
-			strcpy (new_child->name, entry->d_name);
-			new_child->name [strlen (new_child->name)] = '\0';
-
-			//Check if what we tried to open really WAS a directory
-			if (errno != ENOTDIR) //No error message, must have been a directory
+			//Most filesystems tell us the type for free. Only stat files (we need the size and timestamp anyway) and entries of unknown type
+			is_dir = entry->d_type == DT_DIR;
+			if (!is_dir)
+			{
+				if (fstatat (dirfd (to_read), entry->d_name, &status, 0))
+				{
+					printf ("%s%s: Could not stat file\n", parent->path, entry->d_name);
+					exit (-1);
+				}
+				is_dir = S_ISDIR (status.st_mode);
+			}
+
+			//Sockets, FIFOs and device nodes can't be packed
+			if (is_dir || S_ISREG (status.st_mode))
 			{
-				read_dir (new_child, subdir, subdir_name);
-				closedir (subdir);
-				new_child->offset = last_file_created.offset + last_file_created.size;
-				new_child->size = 0;
-				new_child->last_modified = 0;
+				//Initialize the new child
+				if (parent->num_children == capacity)
+				{
+					capacity = capacity ? capacity * 2 : 16;
+					parent->children = realloc (parent->children, capacity * sizeof (struct file_node));
+				}
+				new_child = &(parent->children [parent->num_children]);
+				parent->num_children ++;
+				new_child->offset = 0;
+				new_child->source = -1;
+				new_child->spill = -1;
+				new_child->children = NULL;
+				new_child->num_children = 0;
+				new_child->name = malloc (strlen (entry->d_name)+1);
+				strcpy (new_child->name, entry->d_name);
+				new_child->path = append_dir_path (parent->path, entry->d_name);
+
+				if (is_dir)
+				{
+					new_child->size = 0;
+					new_child->last_modified = 0;
+				}
+				else
+				{
+					new_child->path [strlen (new_child->path)-1] = '\0'; //Remove the '/', just replace it with a '\0' to get a FILE path
+					new_child->size = status.st_size;
+					new_child->last_modified = status.st_mtime;
+				}
 			}
-			else //Not a directory, load it up as a file
+		}
+
+		//Get the next direntry
+		entry = readdir (to_read);
+	}
+	closedir (to_read);
+
+	//The children array won't be reallocated anymore, so now it's safe to hand the subdirectories to other threads
+	//Go by the trailing '/' rather than the size since empty files have a size of 0 too
+	for (loop = 0; loop < parent->num_children; loop ++)
+	{
+		if (parent->children [loop].path [strlen (parent->children [loop].path)-1] == '/')
+			queue_dir (&(parent->children [loop]));
+	}
+}
+
+void queue_dir (struct file_node* dir)
+{
+	pthread_mutex_lock (&scan_lock);
+	if (scan_queue_length == scan_queue_capacity)
+	{
+		scan_queue_capacity = scan_queue_capacity ? scan_queue_capacity * 2 : 64;
+		scan_queue = realloc (scan_queue, scan_queue_capacity * sizeof (struct file_node*));
+	}
+	scan_queue [scan_queue_length] = dir;
+	scan_queue_length ++;
+	scan_pending ++;
+	pthread_cond_signal (&scan_cond);
+	pthread_mutex_unlock (&scan_lock);
+}
+
+void* scan_worker (void* unused)
+{
+	struct file_node* dir;
+
+	pthread_mutex_lock (&scan_lock);
+	while (1)
+	{
+		//Wait for more work until every directory has been scanned
+		while (!scan_queue_length && scan_pending)
+			pthread_cond_wait (&scan_cond, &scan_lock);
+		if (!scan_queue_length)
+			break;
+
+		scan_queue_length --;
+		dir = scan_queue [scan_queue_length];
+		pthread_mutex_unlock (&scan_lock);
+
+		read_dir (dir); //Subdirectories are queued before this one is marked done, so scan_pending can't hit 0 early
+
+		pthread_mutex_lock (&scan_lock);
+		scan_pending --;
+		if (!scan_pending)
+			pthread_cond_broadcast (&scan_cond); //Wake everyone up so they can exit
+	}
+	pthread_mutex_unlock (&scan_lock);
+
+	return NULL;
+}
+
+//One thread per CPU
+int thread_count ()
+{
+	long num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (num_threads < 1)
+		return 1;
+	if (num_threads > MAX_THREADS)
+		return MAX_THREADS;
+	return num_threads;
+}
+
+//Walks the whole directory tree under root with several scanner threads
+void scan_tree (struct file_node* root)
+{
+	pthread_t threads [MAX_THREADS];
+	int num_threads = thread_count ();
+	int loop;
+
+	queue_dir (root);
+	for (loop = 0; loop < num_threads; loop ++)
+		pthread_create (&threads [loop], NULL, scan_worker, NULL);
+	for (loop = 0; loop < num_threads; loop ++)
+		pthread_join (threads [loop], NULL);
+
+	free (scan_queue);
+}
+
+//Compresses one block of data into the LZ4 block format, returns the compressed size
+//out needs room for in_size + in_size/255 + 16 bytes, hash_table for 1 << LZ4_HASH_BITS ints
+int lz4_compress_block (unsigned char* in, int in_size, unsigned char* out, int* hash_table)
+{
+	unsigned char* token;
+	unsigned int sequence;
+	unsigned int candidate_sequence;
+	int position = 0;
+	int anchor = 0; //Start of the literals that haven't been written yet
+	int written = 0;
+	int candidate;
+	int match_length;
+	int length;
+	int hash;
+
+	//-1 everywhere, nothing has been seen yet
+	memset (hash_table, 0xFF, (1 << LZ4_HASH_BITS) * sizeof (int));
+
+	//The format requires the last match to start at least 12 bytes before the end and the last 5 bytes to be literals
+	while (position + 12 <= in_size)
+	{
+		memcpy (&sequence, in + position, 4);
+		hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+		candidate = hash_table [hash];
+		hash_table [hash] = position;
+		if (candidate >= 0)
+			memcpy (&candidate_sequence, in + candidate, 4);
+		if (candidate < 0 || position - candidate > 65535 || candidate_sequence != sequence)
+		{
+			position ++;
+			continue;
+		}
+
+		//Found a match, see how far it goes
+		match_length = 4;
+		while (position + match_length < in_size - 5 && in [candidate + match_length] == in [position + match_length])
+			match_length ++;
+
+		//Token and the literals before the match
+		token = out + written;
+		written ++;
+		length = position - anchor;
+		*token = (length < 15 ? length : 15) << 4;
+		if (length >= 15)
+		{
+			for (length -= 15; length >= 255; length -= 255)
+				out [written++] = 255;
+			out [written++] = length;
+		}
+		memcpy (out + written, in + anchor, position - anchor);
+		written += position - anchor;
+
+		//Match offset and length
+		out [written++] = (position - candidate) & 0xFF;
+		out [written++] = (position - candidate) >> 8;
+		length = match_length - 4;
+		*token |= length < 15 ? length : 15;
+		if (length >= 15)
+		{
+			for (length -= 15; length >= 255; length -= 255)
+				out [written++] = 255;
+			out [written++] = length;
+		}
+
+		position += match_length;
+		anchor = position;
+	}
+
+	//Whatever is left over goes out as literals
+	token = out + written;
+	written ++;
+	length = in_size - anchor;
+	*token = (length < 15 ? length : 15) << 4;
+	if (length >= 15)
+	{
+		for (length -= 15; length >= 255; length -= 255)
+			out [written++] = 255;
+		out [written++] = length;
+	}
+	memcpy (out + written, in + anchor, in_size - anchor);
+	written += in_size - anchor;
+
+	return written;
+}
+
+//Compresses a file into the LZ41 format one block at a time, appending it to the spill file at spill_size. Every block is compressed on its own
+//in needs room for LZ41_BLOCK_SIZE bytes, out for LZ41_BLOCK_SIZE + LZ41_BLOCK_SIZE/255 + 16
+//If compressing actually makes the file smaller it gets pointed at the spill file, returns the new end of the spill file either way
+long compress_file (struct file_node* file, int* hash_table, unsigned char* in, unsigned char* out, int spill, long spill_size)
+{
+	int num_blocks = (file->size + LZ41_BLOCK_SIZE - 1) / LZ41_BLOCK_SIZE;
+	int* offsets = malloc ((num_blocks + 1) * sizeof (int));
+	int trailer [3];
+	int written = 4;
+	int block_size;
+	int compressed_size;
+	size_t total;
+	ssize_t chunk;
+	int input;
+	int loop;
+
+	input = open (file->path, O_RDONLY);
+	if (input < 0)
+	{
+		printf ("%s: Could not open file\n", file->path);
+		exit (-1);
+	}
+
+	if (pwrite (spill, LZ41_HEADER, 4, spill_size) != 4)
+	{
+		printf ("Could not write compressed data to spill file\n");
+		exit (-1);
+	}
+	for (loop = 0; loop < num_blocks && written < file->size; loop ++)
+	{
+		block_size = loop < num_blocks - 1 ? LZ41_BLOCK_SIZE : file->size - loop * LZ41_BLOCK_SIZE;
+		for (total = 0; total < block_size; total += chunk)
+		{
+			chunk = read (input, in + total, block_size - total);
+			if (chunk <= 0)
 			{
-				subdir_name [strlen (subdir_name)-1] = '\0'; //Remove the '/', just replace it with a '\0' to get a FILE path
+				printf ("%s: File changed while packing\n", file->path);
+				exit (-1);
+			}
+		}
+
+		offsets [loop] = written;
+		compressed_size = lz4_compress_block (in, block_size, out, hash_table);
+		if (pwrite (spill, out, compressed_size, spill_size + written) != compressed_size)
+		{
+			printf ("Could not write compressed data to spill file\n");
+			exit (-1);
+		}
+		written += compressed_size;
+	}
+	close (input);
 
-				//Find the VP file offset
-				new_child->offset = last_file_created.offset + last_file_created.size;
+	//Give up as soon as it's clear the file won't get any smaller, then the next file just overwrites what's there
+	if (loop < num_blocks || written + (num_blocks + 1) * sizeof (int) + LZ41_TRAILER_SIZE >= file->size)
+	{
+		free (offsets);
+		return spill_size;
+	}
 
-				//Open the file and read it into memory
-				input_file = fopen (subdir_name, "r");
-				fseek (input_file, 0, SEEK_END);
-				file_size = ftell (input_file);
-				new_child->data = malloc (file_size);
-				fseek (input_file, 0, SEEK_SET);
-				fread (new_child->data, 1, file_size, input_file);
-				fclose (input_file);
+	offsets [num_blocks] = written;
+	trailer [0] = num_blocks + 1;
+	trailer [1] = file->size;
+	trailer [2] = LZ41_BLOCK_SIZE;
+	if (pwrite (spill, offsets, (num_blocks + 1) * sizeof (int), spill_size + written) != (num_blocks + 1) * sizeof (int) || pwrite (spill, trailer, LZ41_TRAILER_SIZE, spill_size + written + (num_blocks + 1) * sizeof (int)) != LZ41_TRAILER_SIZE)
+	{
+		printf ("Could not write compressed data to spill file\n");
+		exit (-1);
+	}
+	free (offsets);
 
-				//Write the file size to the data structure
-				new_child->size = file_size;
+	file->spill = spill;
+	file->spill_offset = spill_size;
+	file->size = written + (num_blocks + 1) * sizeof (int) + LZ41_TRAILER_SIZE;
+	return spill_size + file->size;
+}
 
-				//Update the last_file_created variable
-				last_file_created = *new_child;
+//Makes a flat list of every file on disk under parent
+void collect_files (struct file_node* parent)
+{
+	int loop = 0;
 
-				//Get last modified timestamp
-				stat (subdir_name, &status);
-				new_child->last_modified = status.st_mtime;
+	for (loop; loop < parent->num_children; loop ++)
+	{
+		if (parent->children [loop].size && parent->children [loop].source < 0)
+		{
+			if (file_list_length == file_list_capacity)
+			{
+				file_list_capacity = file_list_capacity ? file_list_capacity * 2 : 64;
+				file_list = realloc (file_list, file_list_capacity * sizeof (struct file_node*));
 			}
+			file_list [file_list_length] = &(parent->children [loop]);
+			file_list_length ++;
+		}
+		else if (!parent->children [loop].size)
+			collect_files (&(parent->children [loop]));
+	}
+}
+
+void* compress_worker (void* spill_ptr)
+{
+	int* hash_table = malloc ((1 << LZ4_HASH_BITS) * sizeof (int));
+	unsigned char* in = malloc (LZ41_BLOCK_SIZE);
+	unsigned char* out = malloc (LZ41_BLOCK_SIZE + LZ41_BLOCK_SIZE / 255 + 16);
+	long spill_size = 0;
+	int next;
 
-			//Cleanup dynamically allocated paths
-			free (subdir_name);
+	while (1)
+	{
+		pthread_mutex_lock (&compress_lock);
+		next = compress_next;
+		compress_next ++;
+		pthread_mutex_unlock (&compress_lock);
+
+		if (next >= file_list_length)
+			break;
+		spill_size = compress_file (file_list [next], hash_table, in, out, *(int*)spill_ptr, spill_size);
+	}
+
+	free (hash_table);
+	free (in);
+	free (out);
+	return NULL;
+}
+
+//Compresses every file in file_list with several threads
+//The spill files go next to the new VP file, so they're on a real disk rather than a tmpfs and the kernel can copy from them
+void compress_tree (char* vp_path)
+{
+	pthread_t threads [MAX_THREADS];
+	int num_threads = thread_count ();
+	char* spill_path = malloc (strlen (vp_path) + 8);
+	int loop;
+
+	for (loop = 0; loop < num_threads; loop ++)
+	{
+		sprintf (spill_path, "%s.XXXXXX", vp_path);
+		spill_files [loop] = mkstemp (spill_path);
+		if (spill_files [loop] < 0)
+		{
+			printf ("Could not create spill file for compressed data\n");
+			exit (-1);
 		}
+		unlink (spill_path); //Gone as soon as it's closed
+		num_spill_files ++;
+	}
+	free (spill_path);
 
-		//Get the next direntry
-		entry = readdir (to_read);
+	for (loop = 0; loop < num_threads; loop ++)
+		pthread_create (&threads [loop], NULL, compress_worker, &(spill_files [loop]));
+	for (loop = 0; loop < num_threads; loop ++)
+		pthread_join (threads [loop], NULL);
+}
+
+//Reads the files to pack from a manifest instead of walking the directory. Takes one path per record, records can either end in
+//newlines or NULs (like the ones yavpu -t and -z print). Anything after a tab is ignored
+void read_manifest (char* manifest_path)
+{
+	FILE* input;
+	size_t size;
+	size_t capacity;
+	size_t chunk;
+	char* buffer;
+	char* record;
+	char* end;
+	char* field;
+	char terminator;
+	int position = 0;
+
+	input = fopen (manifest_path, "r");
+	if (input <= 0)
+	{
+		printf ("%s: No such file or directory\n", manifest_path);
+		exit (-1);
+	}
+
+	//Read until the end rather than asking for the size, so the manifest can be piped in
+	size = 0;
+	capacity = 65536;
+	buffer = malloc (capacity + 1);
+	while ((chunk = fread (buffer + size, 1, capacity - size, input)))
+	{
+		size += chunk;
+		if (size == capacity)
+		{
+			capacity *= 2;
+			buffer = realloc (buffer, capacity + 1);
+		}
+	}
+	fclose (input);
+	buffer [size] = '\0';
+
+	terminator = memchr (buffer, '\0', size) ? '\0' : '\n';
+	record = buffer;
+	while (record < buffer + size)
+	{
+		end = memchr (record, terminator, buffer + size - record);
+		if (!end)
+			end = buffer + size;
+		*end = '\0';
+
+		//Only the path matters
+		field = strchr (record, '\t');
+		if (field)
+			*field = '\0';
+		if (*record && record [strlen (record)-1] == '\r')
+			record [strlen (record)-1] = '\0';
+
+		if (*record)
+		{
+			add_manifest_file (record, position);
+			position ++;
+		}
+		record = end + 1;
+	}
+
+	free (buffer);
+}
+
+void add_manifest_file (char* vp_path, int position)
+{
+	//Manifests usually list everything in a directory together, so remember the last directory instead of looking it up every time
+	//It's only safe to keep the pointer as long as nothing gets added anywhere else
+	static struct file_node* last_dir = NULL;
+	static char* last_dir_path = NULL;
+	static size_t last_dir_length = 0;
+	struct file_node* dir = &file_tree_root;
+	struct file_node* file;
+	struct stat status;
+	char* name;
+	char* slash;
+
+	if (strncmp (vp_path, "data/", 5))
+	{
+		printf ("%s: Manifest paths have to start with the toplevel data directory\n", vp_path);
+		exit (-1);
 	}
+
+	name = strrchr (vp_path, '/') + 1;
+	if (last_dir && name - vp_path == last_dir_length && !strncmp (vp_path, last_dir_path, last_dir_length))
+		dir = last_dir;
+	else
+	{
+		//Find or create every directory on the way
+		for (name = vp_path + 5; (slash = strchr (name, '/')); name = slash + 1)
+		{
+			*slash = '\0';
+			dir = add_manifest_child (dir, name, 1);
+			*slash = '/';
+		}
+		free (last_dir_path);
+		last_dir_length = name - vp_path;
+		last_dir_path = malloc (last_dir_length);
+		memcpy (last_dir_path, vp_path, last_dir_length);
+		last_dir = dir;
+	}
+
+	//A path listed twice is packed once, with the data and position of its last record
+	file = add_manifest_child (dir, name, 0);
+	free (file->path);
+	file->path = malloc (strlen (file_tree_root.path) + strlen (vp_path + 5) + 1);
+	strcpy (file->path, file_tree_root.path);
+	strcat (file->path, vp_path + 5);
+	if (stat (file->path, &status) || !S_ISREG (status.st_mode))
+	{
+		printf ("%s: Could not stat file\n", file->path);
+		exit (-1);
+	}
+	file->size = status.st_size;
+	file->last_modified = status.st_mtime;
+	file->source_offset = position;
+}
+
+//Looks up a child and only creates it if it doesn't exist yet. Names are compared without regard to case, like FreeSpace does
+struct file_node* add_manifest_child (struct file_node* parent, char* name, int is_dir)
+{
+	struct file_node* child;
+	int loop;
+
+	//".." is the backdir marker in VP files, and neither of them should reach outside the directory
+	if (!*name || strlen (name) > 31 || !strcmp (name, ".") || !strcmp (name, ".."))
+	{
+		printf ("%s: Invalid name in manifest\n", name);
+		exit (-1);
+	}
+
+	//Directories made from a manifest are the children without a path
+	for (loop = 0; loop < parent->num_children; loop ++)
+	{
+		child = &(parent->children [loop]);
+		if (strcasecmp (child->name, name))
+			continue;
+
+		if (is_dir != !child->path)
+		{
+			printf ("%s: Listed as both a file and a directory in manifest\n", name);
+			exit (-1);
+		}
+
+		//A later file record also decides how the name is spelled
+		if (!is_dir)
+		{
+			free (child->name);
+			child->name = malloc (strlen (name)+1);
+			strcpy (child->name, name);
+		}
+		return child;
+	}
+
+	parent->num_children ++;
+	parent->children = realloc (parent->children, parent->num_children * sizeof (struct file_node));
+	child = &(parent->children [parent->num_children-1]);
+	child->name = malloc (strlen (name)+1);
+	strcpy (child->name, name);
+	child->path = NULL;
+	child->offset = 0;
+	child->size = 0;
+	child->last_modified = 0;
+	child->source = -1;
+	child->spill = -1;
+	child->num_children = 0;
+	child->children = NULL;
+
+	return child;
+}
+
+int compare_manifest_position (const void* file1, const void* file2)
+{
+	return (*(struct file_node**)file1)->source_offset - (*(struct file_node**)file2)->source_offset;
+}
+
+//Lays out the file data in the order the manifest listed the files in, rather than the order of the tree
+void assign_manifest_offsets ()
+{
+	int loop;
+
+	qsort (file_list, file_list_length, sizeof (struct file_node*), compare_manifest_position);
+	next_offset = sizeof (struct vp_header);
+	for (loop = 0; loop < file_list_length; loop ++)
+	{
+		file_list [loop]->offset = next_offset;
+		next_offset += file_list [loop]->size;
+	}
+}
+
+//Lays out the file data one after another, in the same order write_files writes it
+void assign_offsets (struct file_node* parent)
+{
+	int loop = 0;
+
+	for (loop; loop < parent->num_children; loop ++)
+	{
+		num_direntries ++;
+		if (parent->children [loop].size)
+		{
+			parent->children [loop].offset = next_offset;
+			next_offset += parent->children [loop].size;
+		}
+		else
+		{
+			assign_offsets (&(parent->children [loop]));
+			parent->children [loop].offset = next_offset;
+		}
+	}
+}
+
+//Adds the contents of a VP file to the file tree. Anything already in the tree with the same path gets overridden
+void merge_vp (char* path, int source)
+{
+	struct vp_header header;
+	struct dir_entry* table;
+	struct stat status;
+	size_t table_size;
+	int input;
+
+	input = open (path, O_RDONLY);
+	if (input < 0)
+	{
+		printf ("%s: No such file or directory\n", path);
+		exit (-1);
+	}
+	fstat (input, &status);
+	if (pread (input, &header, sizeof (struct vp_header), 0) != sizeof (struct vp_header) || strncmp (header.vp_header, "VPVP", 4) || header.vp_diroffset < (int)sizeof (struct vp_header) || header.vp_diroffset > status.st_size)
+	{
+		printf ("%s: Not a VP file\n", path);
+		exit (-1);
+	}
+
+	//Only the direntry table is read into memory, file data gets copied straight from this VP into the new one later
+	table_size = status.st_size - header.vp_diroffset;
+	table = malloc (table_size);
+	if (pread (input, table, table_size, header.vp_diroffset) != table_size)
+	{
+		printf ("%s: Could not read direntries\n", path);
+		exit (-1);
+	}
+
+	//The first direntry is the toplevel data directory, start with what's inside of it
+	merge_dir (&file_tree_root, table + 1, table + table_size / sizeof (struct dir_entry), source);
+
+	free (table);
+	source_fds [source] = input;
+}
+
+//Merges one directory's worth of direntries into parent. Works just like parse_dir in vpu.c, returning the number of direntries used up (including the backdir)
+int merge_dir (struct file_node* parent, struct dir_entry* index, struct dir_entry* end, int source)
+{
+	struct file_node* new_child;
+	int loop = 0;
+
+	//All directories end with a backdir entry, except the one at the very end of the file
+	while (&(index [loop]) < end && strncmp (index [loop].de_name, "..", 32))
+	{
+		new_child = merge_child (parent, &(index [loop]), source);
+
+		//Directories have a size of 0, go down it
+		if (!index [loop].de_size)
+			loop += merge_dir (new_child, &(index [loop+1]), end, source) + 1;
+		else
+			loop ++;
+	}
+
+	return loop + 1;
+}
+
+struct file_node* merge_child (struct file_node* parent, struct dir_entry* entry, int source)
+{
+	struct file_node* child;
+	char name [33];
+	int loop;
+
+	//Names that take up all 32 bytes aren't NULL terminated
+	memcpy (name, entry->de_name, 32);
+	name [32] = '\0';
+
+	//FreeSpace doesn't care about case, so neither do we when looking for conflicts
+	for (loop = 0; loop < parent->num_children; loop ++)
+	{
+		if (!strcasecmp (parent->children [loop].name, name))
+			break;
+	}
+
+	if (loop == parent->num_children)
+	{
+		//Nothing there yet, add a new child
+		parent->num_children ++;
+		parent->children = realloc (parent->children, parent->num_children * sizeof (struct file_node));
+		child = &(parent->children [loop]);
+		child->name = malloc (strlen (name)+1);
+		strcpy (child->name, name);
+		child->path = NULL;
+		child->offset = 0;
+		child->size = 0;
+		child->last_modified = 0;
+		child->source = -1;
+		child->spill = -1;
+		child->num_children = 0;
+		child->children = NULL;
+	}
+	else
+	{
+		child = &(parent->children [loop]);
+
+		//A file replacing a directory takes everything in the directory with it
+		if (entry->de_size && !child->size)
+		{
+			free_tree (child);
+			child->num_children = 0;
+			child->children = NULL;
+		}
+
+		//The name might only match without regard to case, the later VP gets to decide how it's spelled too
+		free (child->name);
+		child->name = malloc (strlen (name)+1);
+		strcpy (child->name, name);
+	}
+
+	if (entry->de_size)
+	{
+		child->size = entry->de_size;
+		child->last_modified = entry->de_timestamp;
+		child->source = source;
+		child->source_offset = entry->de_offset;
+	}
+	else
+	{
+		child->size = 0;
+		child->last_modified = 0;
+		child->source = -1;
+	}
+
+	return child;
+}
+
+//Frees everything below root, but not root itself
+void free_tree (struct file_node* root)
+{
+	int loop = 0;
+
+	for (loop; loop < root->num_children; loop ++)
+	{
+		free_tree (&(root->children [loop]));
+		free (root->children [loop].name);
+		free (root->children [loop].path);
+	}
+	free (root->children);
+}
+
+//Copies length bytes between two files. The kernel does the copying when it can, so the data never has to pass through here
+int copy_range (int from, off_t from_offset, int to, off_t to_offset, size_t length)
+{
+	char buffer [65536];
+	ssize_t copied;
+	int use_kernel = 1;
+
+	while (length)
+	{
+		copied = -1;
+		if (use_kernel)
+		{
+			copied = copy_file_range (from, &from_offset, to, &to_offset, length, 0);
+			if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+				use_kernel = 0; //Not supported for these files, do it the old fashioned way
+		}
+		if (!use_kernel)
+		{
+			copied = pread (from, buffer, length < sizeof (buffer) ? length : sizeof (buffer), from_offset);
+			if (copied > 0 && pwrite (to, buffer, copied, to_offset) != copied)
+				return -1;
+			if (copied > 0)
+			{
+				from_offset += copied;
+				to_offset += copied;
+			}
+		}
+
+		//Either an error or the source file is shorter than it should be
+		if (copied <= 0)
+			return -1;
+		length -= copied;
+	}
+
+	return 0;
 }
 
 void write_vp (char* path)
@@ -172,6 +922,7 @@ void write_vp (char* path)
 
 	//Write VP header
 	write_vp_header (write_file);
+	fflush (write_file); //File data gets written straight to the file descriptor
 
 	//Write all file content to the VP file
 	write_files (write_file, &file_tree_root);
@@ -201,7 +952,7 @@ void write_vp_header (FILE* to_write)
 	header.vp_header [2] = 'V';
 	header.vp_header [3] = 'P';
 	header.vp_version = 2;
-	header.vp_diroffset = last_file_created.offset + last_file_created.size;
+	header.vp_diroffset = next_offset;
 	header.vp_direntries = num_direntries;
 
 	//Write the header
@@ -211,21 +962,50 @@ void write_vp_header (FILE* to_write)
 
 void write_files (FILE* to_write, struct file_node* parent)
 {
+	struct file_node* child;
+	int input;
 	int loop = 0;
 
 	for (loop; loop < parent->num_children; loop ++)
 	{
-		if (parent->children [loop].size)
+		child = &(parent->children [loop]);
+		if (child->size)
 		{
-			//Write file data if it is indeed a file
-			fseek (to_write, 0, SEEK_END);
-			fwrite (parent->children [loop].data, 1, parent->children [loop].size, to_write);
-
-			//Cleanup the file data buffer
-			free (parent->children [loop].data);
+			//Copy the file data into the VP file, either from the spill file if it was compressed, from the file on disk or from the VP file it's merged from
+			if (child->spill >= 0)
+			{
+				if (copy_range (child->spill, child->spill_offset, fileno (to_write), child->offset, child->size))
+				{
+					printf ("%s: Could not copy file into VP file\n", child->path);
+					exit (-1);
+				}
+			}
+			else if (child->source < 0)
+			{
+				input = open (child->path, O_RDONLY);
+				if (input < 0)
+				{
+					printf ("%s: Could not open file\n", child->path);
+					exit (-1);
+				}
+				if (copy_range (input, 0, fileno (to_write), child->offset, child->size))
+				{
+					printf ("%s: Could not copy file into VP file\n", child->path);
+					exit (-1);
+				}
+				close (input);
+			}
+			else if (copy_range (source_fds [child->source], child->source_offset, fileno (to_write), child->offset, child->size))
+			{
+				printf ("%s: Could not copy file into VP file\n", child->name);
+				exit (-1);
+			}
 		}
 		else
-			write_files (to_write, &(parent->children [loop])); //Go down a subdirectory and copy those files
+			write_files (to_write, child); //Go down a subdirectory and copy those files
+
+		//Cleanup the path buffer
+		free (child->path);
 	}
 }
 
@@ -268,12 +1048,38 @@ void write_dir_info (FILE* to_write, struct file_node* parent)
 
 int main (int argc, char** argv)
 {
-	FILE* output_file;
-	DIR* input_directory;
+	struct stat status;
+	struct stat source_status;
+	char* manifest = NULL;
+	char* output;
+	char* temp_path = NULL;
+	int temp_file;
+	int compress = 0;
+	int merge = 0;
+	int first_arg = 1;
+	int len;
+	int loop;
 
-	if (argc != 3)
+	//Flags come first
+	while (first_arg < argc)
 	{
-		printf ("Invalid arguments.\nUsage: yavpp <path to new VP file> <toplevel directory of contents>\n");
+		if (!strcmp (argv [first_arg], "-c"))
+			compress = 1;
+		else if (!strcmp (argv [first_arg], "-m"))
+			merge = 1;
+		else if (!strcmp (argv [first_arg], "-f") && first_arg + 1 < argc)
+		{
+			first_arg ++;
+			manifest = argv [first_arg];
+		}
+		else
+			break;
+		first_arg ++;
+	}
+
+	if ((merge && (compress || manifest)) || (merge ? argc - first_arg < 2 : argc - first_arg != 2))
+	{
+		printf ("Invalid arguments.\nUsage: yavpp [-c] [-f <manifest>] <path to new VP file> <toplevel directory of contents>\nyavpp -m <path to new VP file> <VP file> [more VP files...]\n");
 		exit (-1);
 	}
 
@@ -282,41 +1088,102 @@ int main (int argc, char** argv)
 	file_tree_root.size = 0;
 	file_tree_root.name = malloc (5);
 	strcpy (file_tree_root.name, "data");
+	file_tree_root.path = NULL;
+	file_tree_root.source = -1;
 	file_tree_root.num_children = 0;
 	file_tree_root.children = NULL;
-	file_tree_root.data = NULL;
 	file_tree_root.last_modified = 0;
 
-	//Initialize last file created pointer
-	last_file_created = first_dir_entry;
-
-	//Open user specified directory and start reading
-	input_directory = opendir (argv [2]);
-	if (input_directory <= 0)
+	if (!merge)
 	{
-		printf ("%s: No such file or directory\n", argv [2]);
-		exit (-1);
+		//Make sure the user specified directory exists
+		if (stat (argv [first_arg + 1], &status) || !S_ISDIR (status.st_mode))
+		{
+			printf ("%s: No such file or directory\n", argv [first_arg + 1]);
+			exit (-1);
+		}
+
+		//Add the / to the end of the directory name if it isn't there already
+		len = strlen (argv [first_arg + 1]);
+		file_tree_root.path = malloc (len+2);
+		strcpy (file_tree_root.path, argv [first_arg + 1]);
+		if (file_tree_root.path [len-1] != '/')
+		{
+			file_tree_root.path [len] = '/';
+			file_tree_root.path [len+1] = '\0';
+		}
+
+		//Read the directory tree, or just what the manifest asks for
+		if (manifest)
+			read_manifest (manifest);
+		else
+			scan_tree (&file_tree_root);
+
+		collect_files (&file_tree_root);
+		if (compress)
+			compress_tree (argv [first_arg]);
 	}
-	if (strlen (argv [2]) - 2 == '/')
-		read_dir (&file_tree_root, input_directory, argv [2]);
 	else
 	{
-		//Add the / to the end of the directory name
-		int len = strlen (argv [2]);
-		char* new_path = malloc (len+2);
-		new_path [len+1] = '\0';
-		new_path [len] = '/';
-		strcpy (new_path, argv [2]);
+		//Merge the VP files in order, so later ones take priority
+		source_fds = malloc ((argc - first_arg - 1) * sizeof (int));
+		for (loop = first_arg + 1; loop < argc; loop ++)
+			merge_vp (argv [loop], loop - first_arg - 1);
 
-		read_dir (&file_tree_root, input_directory, new_path);
-
-		free (new_path);
+		//Opening the new VP file would truncate it, so if it's also one of the VP files being merged write next to it and move it into place at the end
+		if (!stat (argv [first_arg], &status))
+		{
+			for (loop = first_arg + 1; loop < argc; loop ++)
+			{
+				fstat (source_fds [loop - first_arg - 1], &source_status);
+				if (source_status.st_dev == status.st_dev && source_status.st_ino == status.st_ino)
+					break;
+			}
+			if (loop < argc)
+			{
+				temp_path = malloc (strlen (argv [first_arg]) + 8);
+				sprintf (temp_path, "%s.XXXXXX", argv [first_arg]);
+				temp_file = mkstemp (temp_path);
+				if (temp_file < 0)
+				{
+					printf ("Could not create or open VP file\n");
+					exit (-1);
+				}
+				fchmod (temp_file, status.st_mode & 07777);
+				close (temp_file);
+			}
+		}
 	}
-	closedir (input_directory);
+
+	//Figure out where everything goes in the VP file
+	assign_offsets (&file_tree_root);
+	if (manifest)
+		assign_manifest_offsets ();
 
 	//Write the file tree to the VP file
-	write_vp (argv [1]);
+	output = temp_path ? temp_path : argv [first_arg];
+	write_vp (output);
+	if (temp_path)
+	{
+		if (rename (temp_path, argv [first_arg]))
+		{
+			printf ("%s: Could not replace VP file\n", argv [first_arg]);
+			unlink (temp_path);
+			exit (-1);
+		}
+		free (temp_path);
+	}
 
 	//Cleanup
+	if (source_fds)
+	{
+		for (loop = first_arg + 1; loop < argc; loop ++)
+			close (source_fds [loop - first_arg - 1]);
+		free (source_fds);
+	}
+	for (loop = 0; loop < num_spill_files; loop ++)
+		close (spill_files [loop]);
+	free (file_list);
 	free (file_tree_root.name);
+	free (file_tree_root.path);
 }
@@ -21,28 +21,74 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
 #include "vp.h"
 
 #define MODE_DEFAULT 0
 #define MODE_SINGLE 1
 #define MODE_LIST 2
+#define MODE_DAEMON 3
+#define MODE_UPDATE 4
+
+#define LIST_PATH_SIZE 4096
+
+//A VP file served by the daemon
+struct archive
+{
+	char* path;
+	int fd; //-1 if the file couldn't be loaded
+	struct dir_entry* table; //Only the direntry table is kept in memory, the file tree's names point into it
+	struct file_node root;
+	struct stat status; //What the file looked like when it was loaded, so we can tell when it changes
+	pthread_rwlock_t lock;
+};
 
 char mode = MODE_DEFAULT;
 struct file_node file_tree_root;
 char* file_buf;
 size_t file_size;
 int num_tabs;
+int remove_stale_files = 0; //Only used in MODE_UPDATE
+struct archive* archives;
+int num_archives;
 
 struct file_node* add_child (struct file_node* parent, struct dir_entry* child_data);
-int parse_dir (struct file_node* parent, struct dir_entry* dir);
+int parse_dir (struct file_node* parent, struct dir_entry* dir, char* end);
+void free_tree (struct file_node* root);
 void write_tree (char* path, struct file_node* root);
 void write_dir (char* path, struct file_node* dir);
 void write_file (char* path, struct file_node* file);
+int lz4_decompress_block (unsigned char* in, int in_size, unsigned char* out, unsigned char* out_start, unsigned char* out_end);
+char* lz41_decompress (char* data, int size, int* decompressed_size);
+int extracted_size (struct file_node* file);
+int compare_names (const void* name1, const void* name2);
+void remove_stale (char* path, struct file_node* dir);
+void remove_path (char* path);
 char* parse_path (char* path);
-struct file_node* find_file_by_path (char* path);
+int name_matches (char* name, char* to_match, size_t length);
+struct file_node* find_file_by_path (struct file_node* root, char* path);
+int load_archive (struct archive* vp);
+void unload_archive (struct archive* vp);
+int status_changed (struct stat* old_status, struct stat* new_status);
+void check_archive (struct archive* vp);
+struct file_node* find_archive_file (char* path, struct archive** found_in);
+int list_files (FILE* output, char** path, size_t* capacity, size_t path_length, struct file_node* dir, char* vp_path, int overridden_from, char terminator);
+int serve_request (FILE* replies, int client, char* request);
+void* serve_client (void* client_ptr);
+void run_daemon (char* socket_path);
 
 struct file_node* add_child (struct file_node* parent, struct dir_entry* child_data)
 {
@@ -59,6 +105,7 @@ struct file_node* add_child (struct file_node* parent, struct dir_entry* child_d
 	current_child = &(parent->children [parent->num_children-1]);
 	current_child->offset = child_data->de_offset;
 	current_child->size = child_data->de_size;
+	current_child->last_modified = child_data->de_timestamp;
 	current_child->name = child_data->de_name; //Do note this doesn't actually copy the name, just the pointer to the name string
 
 	//Initialize child's children information
@@ -68,7 +115,7 @@ struct file_node* add_child (struct file_node* parent, struct dir_entry* child_d
 	return current_child;
 }
 
-int parse_dir (struct file_node* parent, struct dir_entry* dir)
+int parse_dir (struct file_node* parent, struct dir_entry* dir, char* end)
 {
 	struct dir_entry* index;
 	int loop = 0;
@@ -80,7 +127,7 @@ int parse_dir (struct file_node* parent, struct dir_entry* dir)
 	index = (struct dir_entry*)((char*)dir + sizeof (struct dir_entry));
 
 	//All directories end with a backdir entry, except the one at the very of the file. Use this to know when to stop traversing the directory.
-	while (strcmp (index [loop].de_name, "..") && &(index [loop]) < file_buf + file_size)
+	while ((char*)&(index [loop+1]) <= end && strcmp (index [loop].de_name, ".."))
 	{
 		//Add child to file tree
 		new_child = add_child (parent, &(index [loop]));
@@ -88,7 +135,7 @@ int parse_dir (struct file_node* parent, struct dir_entry* dir)
 		//Check if child was a directory
 		if (!new_child->size)
 		{	
-			sub_entries = parse_dir (new_child, &(index [loop])); //Child was a directory, start traversing it
+			sub_entries = parse_dir (new_child, &(index [loop]), end); //Child was a directory, start traversing it
 			sub_entries += 2;
 			index = (struct dir_entry*)((char*)&(index [loop]) + sub_entries*sizeof (struct dir_entry));
 			loop = 0;
@@ -103,6 +150,229 @@ int parse_dir (struct file_node* parent, struct dir_entry* dir)
 	return num_entries;
 }
 
+void free_tree (struct file_node* root)
+{
+	int loop = 0;
+
+	for (loop; loop < root->num_children; loop ++)
+		free_tree (&(root->children [loop]));
+	free (root->children);
+}
+
+//Decompresses one LZ4 block into out, returns the decompressed size or -1 if the block is corrupt
+//Matches may reach back as far as out_start, so blocks that depend on the previous ones work too
+int lz4_decompress_block (unsigned char* in, int in_size, unsigned char* out, unsigned char* out_start, unsigned char* out_end)
+{
+	unsigned char* in_end = in + in_size;
+	unsigned char* position = out;
+	unsigned char* match;
+	unsigned char token;
+	size_t length;
+	size_t offset;
+
+	while (in < in_end)
+	{
+		//Literals first
+		token = *in;
+		in ++;
+		length = token >> 4;
+		if (length == 15)
+		{
+			do
+			{
+				if (in >= in_end)
+					return -1;
+				length += *in;
+				in ++;
+			} while (in [-1] == 255);
+		}
+		if (length > in_end - in || length > out_end - position)
+			return -1;
+		memcpy (position, in, length);
+		position += length;
+		in += length;
+
+		//The last sequence is only literals
+		if (in == in_end)
+			break;
+
+		//Then the match
+		if (in_end - in < 2)
+			return -1;
+		offset = in [0] | (in [1] << 8);
+		in += 2;
+		length = token & 15;
+		if (length == 15)
+		{
+			do
+			{
+				if (in >= in_end)
+					return -1;
+				length += *in;
+				in ++;
+			} while (in [-1] == 255);
+		}
+		length += 4;
+		if (!offset || offset > position - out_start || length > out_end - position)
+			return -1;
+
+		//Matches can overlap what they're writing, so copy one byte at a time
+		match = position - offset;
+		while (length --)
+			*(position++) = *(match++);
+	}
+
+	return position - out;
+}
+
+//Returns a buffer with the decompressed file, or NULL if data isn't a valid LZ41 file
+char* lz41_decompress (char* data, int size, int* decompressed_size)
+{
+	int trailer [3]; //Number of offsets, uncompressed size, block size
+	int block_start = 4;
+	int block_end;
+	int table_start;
+	int written = 0;
+	int decompressed;
+	int loop;
+	char* ret;
+
+	if (size < 4 + LZ41_TRAILER_SIZE || strncmp (data, LZ41_HEADER, 4))
+		return NULL;
+	memcpy (trailer, data + size - LZ41_TRAILER_SIZE, LZ41_TRAILER_SIZE);
+	if (trailer [0] < 1 || trailer [0] > (size - 4 - LZ41_TRAILER_SIZE) / (int)sizeof (int) || trailer [1] < 0)
+		return NULL;
+	table_start = size - LZ41_TRAILER_SIZE - trailer [0] * sizeof (int);
+
+	ret = malloc (trailer [1] ? trailer [1] : 1);
+
+	//Blocks sit between consecutive offsets. Offsets equal to where we already are (like the very first one) are skipped, so it
+	//doesn't matter whether a writer stored where each block starts or where each block ends
+	for (loop = 0; loop <= trailer [0]; loop ++)
+	{
+		if (loop < trailer [0])
+			memcpy (&block_end, data + table_start + loop * sizeof (int), sizeof (int));
+		else
+			block_end = table_start;
+		if (block_end == block_start)
+			continue;
+		if (block_end < block_start || block_end > table_start)
+		{
+			free (ret);
+			return NULL;
+		}
+
+		decompressed = lz4_decompress_block ((unsigned char*)data + block_start, block_end - block_start, (unsigned char*)ret + written, (unsigned char*)ret, (unsigned char*)ret + trailer [1]);
+		if (decompressed < 0)
+		{
+			free (ret);
+			return NULL;
+		}
+		written += decompressed;
+		block_start = block_end;
+	}
+
+	if (written != trailer [1])
+	{
+		free (ret);
+		return NULL;
+	}
+
+	*decompressed_size = written;
+	return ret;
+}
+
+//Size of the file once it's extracted, which for compressed files is in the LZ41 trailer
+int extracted_size (struct file_node* file)
+{
+	int size;
+
+	if (file->size < 4 + LZ41_TRAILER_SIZE || strncmp (file_buf + file->offset, LZ41_HEADER, 4))
+		return file->size;
+	memcpy (&size, file_buf + file->offset + file->size - LZ41_TRAILER_SIZE + sizeof (int), sizeof (int));
+	return size;
+}
+
+int compare_names (const void* name1, const void* name2)
+{
+	return strcmp (*(char**)name1, *(char**)name2);
+}
+
+//Deletes everything in an extracted directory that isn't in the VP file anymore
+void remove_stale (char* path, struct file_node* dir)
+{
+	DIR* to_read;
+	struct dirent* entry;
+	char** names;
+	char* name;
+	char* stale_path;
+	int loop;
+
+	to_read = opendir (path);
+	if (!to_read)
+		return;
+
+	//Sort the names so big directories don't take forever
+	names = malloc ((dir->num_children + 1) * sizeof (char*));
+	for (loop = 0; loop < dir->num_children; loop ++)
+		names [loop] = dir->children [loop].name;
+	qsort (names, dir->num_children, sizeof (char*), compare_names);
+
+	entry = readdir (to_read);
+	while (entry)
+	{
+		name = entry->d_name;
+		if (strcmp (name, ".") && strcmp (name, "..") && !bsearch (&name, names, dir->num_children, sizeof (char*), compare_names))
+		{
+			stale_path = malloc (strlen (path) + strlen (name) + 1);
+			strcpy (stale_path, path);
+			strcat (stale_path, name);
+			remove_path (stale_path);
+			free (stale_path);
+		}
+		entry = readdir (to_read);
+	}
+
+	closedir (to_read);
+	free (names);
+}
+
+//Deletes a file, or a directory and everything in it
+void remove_path (char* path)
+{
+	DIR* to_read;
+	struct dirent* entry;
+	struct stat status;
+	char* child_path;
+
+	if (lstat (path, &status))
+		return;
+	if (!S_ISDIR (status.st_mode))
+	{
+		unlink (path);
+		return;
+	}
+
+	to_read = opendir (path);
+	if (to_read)
+	{
+		entry = readdir (to_read);
+		while (entry)
+		{
+			if (strcmp (entry->d_name, ".") && strcmp (entry->d_name, ".."))
+			{
+				child_path = malloc (strlen (path) + strlen (entry->d_name) + 2);
+				sprintf (child_path, "%s/%s", path, entry->d_name);
+				remove_path (child_path);
+				free (child_path);
+			}
+			entry = readdir (to_read);
+		}
+		closedir (to_read);
+	}
+	rmdir (path);
+}
+
 void write_file (char* path, struct file_node* file)
 {
 	if (mode != MODE_LIST)
@@ -111,8 +381,12 @@ void write_file (char* path, struct file_node* file)
 		size_t name_length;
 		size_t path_length;
 		char* full_path; //Directory path + the name of the file
+		char* decompressed;
+		int decompressed_size;
 		int loop = 0;
 		FILE* output;
+		struct stat status;
+		struct timespec times [2];
 
 		//Memory management with full path buffer
 		path_length = strlen (path);
@@ -132,6 +406,20 @@ void write_file (char* path, struct file_node* file)
 		for (loop; loop < total_length; loop ++) //Copy name into path
 			full_path [loop] = file->name [loop-path_length];
 
+		//When updating, leave files alone if they already match the VP file
+		if (mode == MODE_UPDATE && !lstat (full_path, &status))
+		{
+			if (S_ISREG (status.st_mode) && status.st_size == extracted_size (file) && status.st_mtime == file->last_modified)
+			{
+				free (full_path);
+				return;
+			}
+
+			//Anything that isn't a regular file is in the way, like a directory that became a file in the VP file
+			if (!S_ISREG (status.st_mode))
+				remove_path (full_path);
+		}
+
 		//Write data to file
 		output = fopen (full_path, "w");
 		if (output <= 0)
@@ -152,10 +440,26 @@ void write_file (char* path, struct file_node* file)
 				exit (-1);
 			}
 		}
-		fwrite (file_buf + file->offset, 1, file->size, output);
 
-		//Cleanup
+		//Compressed files get decompressed on the way out, anything else is written as is
+		decompressed = lz41_decompress (file_buf + file->offset, file->size, &decompressed_size);
+		if (decompressed)
+		{
+			fwrite (decompressed, 1, decompressed_size, output);
+			free (decompressed);
+		}
+		else
+			fwrite (file_buf + file->offset, 1, file->size, output);
+
 		fclose (output);
+
+		//Use the timestamp from the VP file, so a later update can tell whether the file changed
+		times [0].tv_nsec = UTIME_OMIT;
+		times [1].tv_sec = file->last_modified;
+		times [1].tv_nsec = 0;
+		utimensat (AT_FDCWD, full_path, times, 0);
+
+		//Cleanup
 		free (full_path);
 	}
 	else
@@ -176,6 +480,7 @@ void write_dir (char* path, struct file_node* dir)
 		size_t path_length;
 		char* new_path; //Directory path + directory name
 		int loop = 0;
+		struct stat status;
 
 		//Memory management with new path buffer;
 		path_length = strlen (path);
@@ -198,7 +503,16 @@ void write_dir (char* path, struct file_node* dir)
 		new_path [loop] = '/';
 		new_path [loop+1] = '\0';
 
-		if (mkdir (new_path, 0777)); //Create directory
+		//When updating, a file that became a directory in the VP file is in the way. Check without the '/' so symlinks aren't followed
+		if (mode == MODE_UPDATE)
+		{
+			new_path [loop] = '\0';
+			if (!lstat (new_path, &status) && !S_ISDIR (status.st_mode))
+				remove_path (new_path);
+			new_path [loop] = '/';
+		}
+
+		if (mkdir (new_path, 0777)) //Create directory
 		{
 			//Error checking
 			if (errno == ENOENT || errno == ENOTDIR)
@@ -218,6 +532,10 @@ void write_dir (char* path, struct file_node* dir)
 			}
 		}
 
+		//Get rid of whatever was deleted from the VP file since the last time it was extracted
+		if (mode == MODE_UPDATE && remove_stale_files)
+			remove_stale (new_path, dir);
+
 		//Take care of everything INSIDE the directory
 		write_tree (new_path, dir);
 
@@ -268,18 +586,22 @@ char* parse_path (char* path)
 	return ret;
 }
 
-struct file_node* find_file_by_path (char* path)
+//Checks a file node's name against the first length characters of a path component. FreeSpace doesn't care about case, so neither do we
+int name_matches (char* name, char* to_match, size_t length)
+{
+	return !strncasecmp (name, to_match, length) && !name [length];
+}
+
+//Returns NULL if the path isn't in the tree
+struct file_node* find_file_by_path (struct file_node* root, char* path)
 {
-	struct file_node* current = &file_tree_root;
+	struct file_node* current = root;
 	char* current_dir_name;
 	int loop;
 	int position = 5;
 
-	if (strncmp (path, "data", 4))
-	{
-		printf ("Path not found in given VP file (Perhaps forgot about the toplevel data directory?)\n");
-		exit (-1);
-	}
+	if (strncasecmp (path, "data/", 5))
+		return NULL;
 
 	current_dir_name = parse_path (path + position); //Skip data directory
 
@@ -288,13 +610,13 @@ struct file_node* find_file_by_path (char* path)
 	{
 		for (loop = 0; loop < current->num_children; loop ++)
 		{
-			if (!strncmp (current->children [loop].name, current_dir_name, strlen (current_dir_name)-1))
+			if (name_matches (current->children [loop].name, current_dir_name, strlen (current_dir_name)-1))
 				break;
 		}
 		if (loop == current->num_children)
 		{
-			printf ("Path not found in given VP file\n");
-			exit (-1);
+			free (current_dir_name);
+			return NULL;
 		}
 
 		//Update the current node
@@ -309,62 +631,488 @@ struct file_node* find_file_by_path (char* path)
 	//Check the last directory in the path for the filename
 	for (loop = 0; loop < current->num_children; loop ++)
 	{
-		if (!strncmp (current->children [loop].name, current_dir_name, strlen (current_dir_name)-1))
+		if (name_matches (current->children [loop].name, current_dir_name, strlen (current_dir_name)))
 			break;
 	}
+	free (current_dir_name);
 	if (loop == current->num_children)
+		return NULL;
+
+	return &(current->children [loop]);
+}
+
+int load_archive (struct archive* vp)
+{
+	struct vp_header header;
+	size_t table_size;
+
+	vp->fd = open (vp->path, O_RDONLY);
+	if (vp->fd < 0)
+		return -1;
+	fstat (vp->fd, &(vp->status));
+
+	//Read the header and check it makes sense
+	if (pread (vp->fd, &header, sizeof (struct vp_header), 0) != sizeof (struct vp_header) || strncmp (header.vp_header, "VPVP", 4) || header.vp_diroffset < (int)sizeof (struct vp_header) || header.vp_diroffset >= vp->status.st_size)
+	{
+		close (vp->fd);
+		vp->fd = -1;
+		return -1;
+	}
+
+	//Read the direntry table, file data stays on disk until someone asks for it
+	table_size = vp->status.st_size - header.vp_diroffset;
+	vp->table = malloc (table_size);
+	if (pread (vp->fd, vp->table, table_size, header.vp_diroffset) != table_size)
+	{
+		free (vp->table);
+		close (vp->fd);
+		vp->fd = -1;
+		return -1;
+	}
+
+	vp->root.offset = header.vp_diroffset;
+	vp->root.size = 0;
+	vp->root.num_children = 0;
+	vp->root.children = NULL;
+	vp->root.name = "data";
+	parse_dir (&(vp->root), vp->table, (char*)vp->table + table_size);
+
+	return 0;
+}
+
+void unload_archive (struct archive* vp)
+{
+	if (vp->fd >= 0)
+	{
+		free_tree (&(vp->root));
+		free (vp->table);
+		close (vp->fd);
+		vp->fd = -1;
+	}
+	vp->root.num_children = 0;
+	vp->root.children = NULL;
+}
+
+int status_changed (struct stat* old_status, struct stat* new_status)
+{
+	//Whole seconds aren't enough, a rewrite of the same size within one second would go unnoticed
+	return old_status->st_ino != new_status->st_ino || old_status->st_dev != new_status->st_dev || old_status->st_size != new_status->st_size ||
+		old_status->st_mtim.tv_sec != new_status->st_mtim.tv_sec || old_status->st_mtim.tv_nsec != new_status->st_mtim.tv_nsec ||
+		old_status->st_ctim.tv_sec != new_status->st_ctim.tv_sec || old_status->st_ctim.tv_nsec != new_status->st_ctim.tv_nsec;
+}
+
+//Reloads the archive if it was replaced or modified since we last read it
+void check_archive (struct archive* vp)
+{
+	struct stat status;
+	int changed;
+
+	if (stat (vp->path, &status))
+		return;
+
+	pthread_rwlock_rdlock (&(vp->lock));
+	changed = status_changed (&(vp->status), &status);
+	pthread_rwlock_unlock (&(vp->lock));
+	if (!changed)
+		return;
+
+	//Somebody else may have beaten us to the reload
+	pthread_rwlock_wrlock (&(vp->lock));
+	if (status_changed (&(vp->status), &status))
 	{
-		printf ("Path not found in given VP file\n");
+		unload_archive (vp);
+		if (load_archive (vp))
+			vp->status = status; //Probably still being written, don't retry until it changes again
+	}
+	pthread_rwlock_unlock (&(vp->lock));
+}
+
+//Looks for a file in every archive, starting with the last one given so later archives override earlier ones like yavpp -m does
+//On success the archive is returned read locked and the caller has to unlock it
+struct file_node* find_archive_file (char* path, struct archive** found_in)
+{
+	struct file_node* found;
+	int loop;
+
+	for (loop = num_archives - 1; loop >= 0; loop --)
+	{
+		check_archive (&(archives [loop]));
+
+		pthread_rwlock_rdlock (&(archives [loop].lock));
+		found = find_file_by_path (&(archives [loop].root), path);
+		if (found && found->size)
+		{
+			*found_in = &(archives [loop]);
+			return found;
+		}
+		pthread_rwlock_unlock (&(archives [loop].lock));
+	}
+
+	return NULL;
+}
+
+//Prints one record per file with its full path, offset, size, timestamp and optionally the VP file, separated by tabs
+//*path is a malloced buffer of *capacity bytes holding the path of dir, it gets reallocated when a path doesn't fit
+//Files that are also in archives [overridden_from] or later are left out, since requests for them go to those archives instead
+//Returns the number of records printed
+int list_files (FILE* output, char** path, size_t* capacity, size_t path_length, struct file_node* dir, char* vp_path, int overridden_from, char terminator)
+{
+	struct file_node* found;
+	size_t name_length;
+	int count = 0;
+	int later;
+	int loop = 0;
+
+	for (loop; loop < dir->num_children; loop ++)
+	{
+		name_length = strlen (dir->children [loop].name);
+		while (path_length + name_length + 2 > *capacity)
+		{
+			*capacity *= 2;
+			*path = realloc (*path, *capacity);
+		}
+		(*path) [path_length] = '/';
+		memcpy (*path + path_length + 1, dir->children [loop].name, name_length + 1);
+
+		if (dir->children [loop].size)
+		{
+			//Match the same way find_archive_file does
+			for (later = overridden_from; later < num_archives; later ++)
+			{
+				found = find_file_by_path (&(archives [later].root), *path);
+				if (found && found->size)
+					break;
+			}
+			if (later < num_archives)
+				continue;
+
+			fprintf (output, "%s\t%d\t%d\t%ld", *path, dir->children [loop].offset, dir->children [loop].size, (long)dir->children [loop].last_modified);
+			if (vp_path)
+				fprintf (output, "\t%s", vp_path);
+			putc (terminator, output);
+			count ++;
+		}
+		else
+			count += list_files (output, path, capacity, path_length + name_length + 1, &(dir->children [loop]), vp_path, overridden_from, terminator);
+	}
+	(*path) [path_length] = '\0';
+
+	return count;
+}
+
+//Handles one line of the daemon protocol. Returns -1 if the connection should be dropped
+int serve_request (FILE* replies, int client, char* request)
+{
+	struct archive* vp;
+	struct file_node* file;
+	char* path;
+	size_t path_capacity;
+	char header [64];
+	char* listing;
+	size_t listing_size;
+	FILE* listing_output;
+	off_t offset;
+	ssize_t sent;
+	long timestamp;
+	int size;
+	int count;
+	int data;
+	int loop;
+
+	if (!strcmp (request, "LIST"))
+	{
+		//Keep everything locked so nothing gets reloaded while the archives are checked against each other
+		for (loop = 0; loop < num_archives; loop ++)
+		{
+			check_archive (&(archives [loop]));
+			pthread_rwlock_rdlock (&(archives [loop].lock));
+		}
+
+		//Build the listing in memory, a client that doesn't read its reply must not hold up reloads
+		//Only list the files STAT and READ would actually serve, later archives override earlier ones
+		listing_output = open_memstream (&listing, &listing_size);
+		path_capacity = LIST_PATH_SIZE;
+		path = malloc (path_capacity);
+		count = 0;
+		for (loop = 0; loop < num_archives; loop ++)
+		{
+			strcpy (path, "data");
+			count += list_files (listing_output, &path, &path_capacity, 4, &(archives [loop].root), archives [loop].path, loop + 1, '\n');
+			pthread_rwlock_unlock (&(archives [loop].lock));
+		}
+		fclose (listing_output);
+		free (path);
+
+		//Count first so the client knows how many lines to expect
+		fprintf (replies, "OK %d\n", count);
+		fwrite (listing, 1, listing_size, replies);
+		free (listing);
+		return 0;
+	}
+
+	if (strncmp (request, "STAT ", 5) && strncmp (request, "READ ", 5) && strncmp (request, "OPEN ", 5))
+	{
+		fprintf (replies, "ERR Unknown request\n");
+		return 0;
+	}
+
+	file = find_archive_file (request + 5, &vp);
+	if (!file)
+	{
+		fprintf (replies, "ERR Path not found\n");
+		return 0;
+	}
+
+	if (!strncmp (request, "STAT ", 5))
+	{
+		//Copy what we need and unlock before writing anything to the client
+		offset = file->offset;
+		size = file->size;
+		timestamp = file->last_modified;
+		pthread_rwlock_unlock (&(vp->lock));
+		fprintf (replies, "OK %ld\t%d\t%ld\t%s\n", (long)offset, size, timestamp, vp->path);
+		return 0;
+	}
+
+	//Hold on to our own descriptor so a reload doesn't have to wait for a slow client
+	data = dup (vp->fd);
+	offset = file->offset;
+	count = file->size;
+	pthread_rwlock_unlock (&(vp->lock));
+
+	if (!strncmp (request, "OPEN ", 5))
+	{
+		//Hand the client the VP file itself along with where to find the data in it
+		struct msghdr message = {0};
+		struct iovec reply;
+		struct cmsghdr* control;
+		char control_buf [CMSG_SPACE (sizeof (int))];
+
+		fflush (replies);
+		reply.iov_base = header;
+		reply.iov_len = snprintf (header, sizeof (header), "OK %ld\t%d\n", (long)offset, count);
+		message.msg_iov = &reply;
+		message.msg_iovlen = 1;
+		message.msg_control = control_buf;
+		message.msg_controllen = sizeof (control_buf);
+		control = CMSG_FIRSTHDR (&message);
+		control->cmsg_level = SOL_SOCKET;
+		control->cmsg_type = SCM_RIGHTS;
+		control->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (control), &data, sizeof (int));
+
+		sent = sendmsg (client, &message, MSG_NOSIGNAL);
+		close (data);
+		return sent < 0 ? -1 : 0;
+	}
+
+	//READ, compressed files have to be read in and decompressed
+	if (count >= 4 + LZ41_TRAILER_SIZE && pread (data, header, 4, offset) == 4 && !strncmp (header, LZ41_HEADER, 4))
+	{
+		char* compressed = malloc (count);
+		char* decompressed = NULL;
+		int decompressed_size;
+
+		if (pread (data, compressed, count, offset) == count)
+			decompressed = lz41_decompress (compressed, count, &decompressed_size);
+		free (compressed);
+		if (decompressed)
+		{
+			fprintf (replies, "OK %d\n", decompressed_size);
+			fwrite (decompressed, 1, decompressed_size, replies);
+			free (decompressed);
+			close (data);
+			return 0;
+		}
+	}
+
+	//Let the kernel copy the file data straight from the VP file to the socket
+	fprintf (replies, "OK %d\n", count);
+	fflush (replies);
+	while (count)
+	{
+		sent = sendfile (client, data, &offset, count);
+		if (sent <= 0)
+			break;
+		count -= sent;
+	}
+	close (data);
+
+	return count ? -1 : 0;
+}
+
+void* serve_client (void* client_ptr)
+{
+	int client = (intptr_t)client_ptr;
+	FILE* requests = fdopen (client, "r");
+	FILE* replies = fdopen (dup (client), "w");
+	char* line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+
+	//One request per line, until the client hangs up
+	while ((length = getline (&line, &line_size, requests)) > 0)
+	{
+		while (length && (line [length-1] == '\n' || line [length-1] == '\r'))
+			line [--length] = '\0';
+		if (serve_request (replies, client, line) || fflush (replies))
+			break;
+	}
+
+	free (line);
+	fclose (replies);
+	fclose (requests);
+
+	return NULL;
+}
+
+void run_daemon (char* socket_path)
+{
+	struct sockaddr_un address;
+	struct stat status;
+	pthread_t thread;
+	int server;
+	int client;
+
+	if (strlen (socket_path) >= sizeof (address.sun_path))
+	{
+		printf ("%s: Socket path too long\n", socket_path);
 		exit (-1);
 	}
 
-	return &(current->children [loop]);
+	//Clean up after a previous daemon, but don't clobber anything that isn't a socket
+	if (!lstat (socket_path, &status))
+	{
+		if (!S_ISSOCK (status.st_mode))
+		{
+			printf ("%s: File exists\n", socket_path);
+			exit (-1);
+		}
+		unlink (socket_path);
+	}
+
+	server = socket (AF_UNIX, SOCK_STREAM, 0);
+	bzero (&address, sizeof (address));
+	address.sun_family = AF_UNIX;
+	strcpy (address.sun_path, socket_path);
+	if (server < 0 || bind (server, (struct sockaddr*)&address, sizeof (address)) || listen (server, SOMAXCONN))
+	{
+		printf ("%s: Could not create socket\n", socket_path);
+		exit (-1);
+	}
+
+	signal (SIGPIPE, SIG_IGN); //Clients hanging up mid-reply shouldn't kill the daemon
+
+	//Every client gets its own thread
+	while (1)
+	{
+		client = accept (server, NULL, NULL);
+		if (client < 0)
+			continue;
+		if (pthread_create (&thread, NULL, serve_client, (void*)(intptr_t)client))
+			close (client);
+		else
+			pthread_detach (thread);
+	}
 }
 
 int main (int argc, char** argv)
 {
 	int path_arg = 1;
 	int vp_file_arg = 2;
-	FILE* input;
+	int input;
+	struct stat status;
+	int update;
 
 	//Argument sanity check
-	if (argc < 3 || argc == 4 || argc > 5)
+	update = argc > 1 && (!strcmp (argv [1], "-u") || !strcmp (argv [1], "-U"));
+	if ((argc < 3 || argc == 4 || argc > 5 || update) && (argc < 4 || strcmp (argv [1], "-d")) && (argc != 4 || !update))
 	{
-		printf ("Invalid arguments.\nUsage: yavpu <extraction path> <to extract>\nyavpu -s <extraction path> <to extract> <specific file to extract>\nyavpu -l <to extract>\n");
+		printf ("Invalid arguments.\nUsage: yavpu <extraction path> <to extract>\nyavpu -s <extraction path> <to extract> <specific file to extract>\nyavpu -u <extraction path> <to extract>\nyavpu -U <extraction path> <to extract>\nyavpu -l <to extract>\nyavpu -t <to extract>\nyavpu -z <to extract>\nyavpu -d <socket path> <VP file> [more VP files...]\n");
 		exit (-1);
 	}
 
+	if (argc == 3 && (!strcmp (argv [1], "-t") || !strcmp (argv [1], "-z")))
+	{
+		//Manifests only need the direntries, don't bother reading the file data
+		struct archive vp;
+		size_t path_capacity = LIST_PATH_SIZE;
+		char* path = malloc (path_capacity);
+
+		vp.path = argv [2];
+		if (load_archive (&vp))
+		{
+			printf ("%s: Could not load VP file\n", vp.path);
+			exit (-1);
+		}
+
+		setvbuf (stdout, NULL, _IOFBF, 65536);
+		strcpy (path, "data");
+		list_files (stdout, &path, &path_capacity, 4, &(vp.root), NULL, num_archives, argv [1] [1] == 'z' ? '\0' : '\n');
+		free (path);
+
+		unload_archive (&vp);
+		return 0;
+	}
+
+	if (argc >= 4 && !strcmp (argv [1], "-d"))
+	{
+		//Load everything up front so the first clients don't have to wait
+		mode = MODE_DAEMON;
+		num_archives = argc - 3;
+		archives = malloc (num_archives * sizeof (struct archive));
+		for (path_arg = 0; path_arg < num_archives; path_arg ++)
+		{
+			archives [path_arg].path = argv [path_arg + 3];
+			pthread_rwlock_init (&(archives [path_arg].lock), NULL);
+			if (load_archive (&(archives [path_arg])))
+			{
+				printf ("%s: Could not load VP file\n", archives [path_arg].path);
+				exit (-1);
+			}
+		}
+		run_daemon (argv [2]);
+	}
+
 	if (!strcmp (argv [1], "-s"))
 	{
 		mode = MODE_SINGLE;
 		path_arg ++;
 		vp_file_arg ++;
 	}
+	else if (!strcmp (argv [1], "-u") || !strcmp (argv [1], "-U"))
+	{
+		mode = MODE_UPDATE;
+		remove_stale_files = argv [1] [1] == 'U';
+		path_arg ++;
+		vp_file_arg ++;
+	}
 	else if (!strcmp (argv [1], "-l"))
+	{
 		mode = MODE_LIST;
+		setvbuf (stdout, NULL, _IOFBF, 65536);
+	}
 
 	//Open VP file
-	input = fopen (argv [vp_file_arg], "r");
-	if (input <= 0)
+	input = open (argv [vp_file_arg], O_RDONLY);
+	if (input < 0)
 	{
 		printf ("%s: No such file or directory\n", argv [vp_file_arg]);
 		exit (-1);
 	}
 
-	//Determine the size of the file
-	fseek (input, 0, SEEK_END);
-	file_size = ftell (input);
-
-	//Memory management for file buffer
-	file_buf = malloc (file_size);
-
-	//Read VP file into memory
-	fseek (input, 0, SEEK_SET);
-	fread (file_buf, 1, file_size, input);
-	fclose (input); //Done with the file at this point
+	//Map the VP file into memory rather than reading all of it, so file data that isn't needed (like unchanged files when updating) never gets read
+	fstat (input, &status);
+	file_size = status.st_size;
+	if (file_size < sizeof (struct vp_header) || (file_buf = mmap (NULL, file_size, PROT_READ, MAP_PRIVATE, input, 0)) == MAP_FAILED)
+	{
+		printf ("Not a VP file\n");
+		exit (-1);
+	}
+	close (input); //Done with the file at this point
 
 	//Parse VP header and initialize root of file tree
-	if (strncmp (((struct vp_header*)file_buf)->vp_header, "VPVP", 4))
+	if (strncmp (((struct vp_header*)file_buf)->vp_header, "VPVP", 4) || ((struct vp_header*)file_buf)->vp_diroffset < (int)sizeof (struct vp_header) || ((struct vp_header*)file_buf)->vp_diroffset >= file_size)
 	{
 		printf ("Not a VP file\n");
 		exit (-1);
@@ -377,7 +1125,7 @@ int main (int argc, char** argv)
 	memcpy (file_tree_root.name, "data\0", 5); //The VP specs say there will ALWAYS be a toplevel directory called data
 
 	//Start parsing the memory image of the VP file
-	parse_dir (&file_tree_root, (struct dir_entry*)(file_buf + ((struct vp_header*)file_buf)->vp_diroffset));
+	parse_dir (&file_tree_root, (struct dir_entry*)(file_buf + ((struct vp_header*)file_buf)->vp_diroffset), file_buf + file_size);
 
 	if (mode != MODE_SINGLE)
 	{
@@ -399,7 +1147,17 @@ int main (int argc, char** argv)
 	}
 	else
 	{
-		struct file_node* target = find_file_by_path (argv [4]);
+		struct file_node* target = find_file_by_path (&file_tree_root, argv [4]);
+		if (strncasecmp (argv [4], "data/", 5))
+		{
+			printf ("Path not found in given VP file (Perhaps forgot about the toplevel data directory?)\n");
+			exit (-1);
+		}
+		if (!target)
+		{
+			printf ("Path not found in given VP file\n");
+			exit (-1);
+		}
 		if (argv [path_arg] [strlen (argv [path_arg]) - 1] == '/')
 			write_file (argv [path_arg], target); //Write the single target file
 		else
@@ -418,6 +1176,6 @@ int main (int argc, char** argv)
 	}
 
 	//Cleanup
-	free (file_buf);
+	munmap (file_buf, file_size);
 	free (file_tree_root.name);
 }